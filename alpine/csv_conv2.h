@@ -71,6 +71,16 @@ int getSize (ifstream& myfile)
   return (int) (end-begin);
 }
 
+// Prints the detected files to console
+void printVector(vector<string> fileList) {
+  cout << endl << endl << fileList.size() << " file(s) for conversion:"  << endl;
+
+  for(int i=0; i<fileList.size(); i++){
+    cout << fileList[i] << endl;
+  }
+  cout << endl;
+}
+
 int convertFile(string binFileName, char delim){
 
   ifstream binFile;
@@ -1,6 +1,10 @@
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <iostream>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <thread>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/strand.hpp>
@@ -97,54 +101,83 @@ int main(int argc, char* argv[]) try {
   // Create aliases to make the code easier to read.
   namespace gcs = google::cloud::storage;
 
-  auto client = gcs::Client::CreateDefaultClient().value();
-  vector<string> fileList = ListObjectsWithPrefix(client, {bucket_name, "unprocessed"});
-  printVector(fileList);
+  po::variables_map vm = parse_args(argc, argv);
 
-  // Create a client to communicate with Google Cloud Storage. This client
-  // uses the default configuration for authentication and project id.
-  google::cloud::StatusOr<gcs::Client> dl_client =
-      gcs::Client::CreateDefaultClient();
+  if (vm.count("help")) return 0;
 
-  if (!dl_client) {
-    std::cerr << "Failed to create Storage Client, status=" << dl_client.status() << "\n";
-    return 1;
-  }
+  // Bind the port before anything slow, so a cold start is accepting connections as soon as possible
+  auto address = asio::ip::make_address(vm["address"].as<std::string>());
+  auto port = vm["port"].as<std::uint16_t>();
+  asio::io_context ioc{/*concurrency_hint=*/1};
+  tcp::acceptor acceptor{ioc, {address, port}};
+  std::cout << "Listening on " << address << ":" << port << std::endl;
 
-  boost::filesystem::create_directory(raw_data_dir);
+  // The client is created and the files listed and downloaded in the background. Requests wait on filesReady
+  vector<string> fileList;
+  std::mutex filesMutex;
+  std::condition_variable filesCv;
+  bool filesReady = false;
+
+  std::thread([&] {
+    // Create a client to communicate with Google Cloud Storage. This client
+    // uses the default configuration for authentication and project id.
+    int const attempts = 5;
+    google::cloud::StatusOr<gcs::Client> client = gcs::Client::CreateDefaultClient();
+    for (int attempt = 1, delay = 1; !client && attempt < attempts; attempt++, delay *= 2) {
+      std::cerr << "Failed to create Storage Client (attempt " << attempt << " of " << attempts << "), status="
+                << client.status() << ", retrying in " << delay << "s\n";
+      std::this_thread::sleep_for(std::chrono::seconds(delay));
+      client = gcs::Client::CreateDefaultClient();
+    }
+    if (!client) {
+      // Nothing can be served without it. Exit, as startup failures always did, so the platform restarts us
+      std::cerr << "Failed to create Storage Client, status=" << client.status() << "\n";
+      std::exit(1);
+    }
 
-  for(int i=0; i < fileList.size(); i++) {
+    vector<string> files = ListObjectsWithPrefix(*client, {bucket_name, "unprocessed"});
+    printVector(files);
 
-    std::string base = raw_data_dir;
-    std::vector<std::string> results;
-    boost::split(results, fileList[i], [](char c){return c == '/';});
+    boost::filesystem::create_directory(raw_data_dir);
 
-    if (results.size() > 2) {
-      for (int i(1); i< results.size()-1; i++) {
+    for(int i=0; i < files.size(); i++) {
 
-        base += "/";
-        base +=  results[1];
-        boost::filesystem::create_directory(base);
-      }
-    }
+      std::string base = raw_data_dir;
+      std::vector<std::string> results;
+      boost::split(results, files[i], [](char c){return c == '/';});
 
-    std::string abs_dl_path = "/r/" + fileList[i];
-    dl_client->DownloadToFile(bucket_name, fileList[i], abs_dl_path);
+      if (results.size() > 2) {
+        for (int i(1); i< results.size()-1; i++) {
 
-    fileList[i] = abs_dl_path;
-  }
+          base += "/";
+          base +=  results[1];
+          boost::filesystem::create_directory(base);
+        }
+      }
 
-  printVector(fileList);
+      std::string abs_dl_path = "/r/" + files[i];
+      client->DownloadToFile(bucket_name, files[i], abs_dl_path);
 
-  po::variables_map vm = parse_args(argc, argv);
+      files[i] = abs_dl_path;
+    }
 
-  if (vm.count("help")) return 0;
+    printVector(files);
 
-  auto address = asio::ip::make_address(vm["address"].as<std::string>());
-  auto port = vm["port"].as<std::uint16_t>();
-  std::cout << "Listening on " << address << ":" << port << std::endl;
+    std::lock_guard<std::mutex> lock(filesMutex);
+    fileList = std::move(files);
+    filesReady = true;
+    filesCv.notify_all();
+  }).detach();
 
-  auto handle_session = [&fileList](tcp::socket socket) {
+  // The files are downloaded once above, so a file only needs converting once. Files are added to converted when
+  // their conversion succeeds; while one is in converting, other sessions wait for it rather than convert it again
+  std::set<std::string> converted, converting;
+  std::mutex convertedMutex;
+  std::condition_variable convertedCv;
+  long cacheHits = 0, cacheMisses = 0;
+
+  auto handle_session = [&fileList, &filesMutex, &filesCv, &filesReady, &converted, &converting, &convertedMutex,
+                         &convertedCv, &cacheHits, &cacheMisses](tcp::socket socket) {
     auto report_error = [](be::error_code ec, char const* what) {
       std::cerr << what << ": " << ec.message() << "\n";
     };
@@ -159,19 +192,45 @@ int main(int argc, char* argv[]) try {
       if (ec == be::http::error::end_of_stream) break;
       if (ec) return report_error(ec, "read");
 
+      // Wait for the startup downloads; fileList doesn't change after that
+      {
+        std::unique_lock<std::mutex> lock(filesMutex);
+        filesCv.wait(lock, [&filesReady] { return filesReady; });
+      }
+
       char delim = ',';
       // if (fileList.size() == 0) return 1; //return error if there were no files to convert, so we know about it
 
       bool conversionFailure = false;
       for(int i=0; i < fileList.size(); i++){
         // cout << "Converting: " << fileList[i] << endl;
-        if (convertFile(fileList[i], delim) != 0){
+        {
+          std::unique_lock<std::mutex> lock(convertedMutex);
+          convertedCv.wait(lock, [&] { return converting.count(fileList[i]) == 0; });
+          if (converted.count(fileList[i])) {
+            cacheHits++;
+            continue;
+          }
+          cacheMisses++;
+          converting.insert(fileList[i]);
+        }
+
+        bool ok = convertFile(fileList[i], delim) == 0;
+        if (!ok){
           cout << fileList[i] << " failed to convert" << endl;
           conversionFailure = true;
         }
+
+        std::lock_guard<std::mutex> lock(convertedMutex);
+        converting.erase(fileList[i]);
+        if (ok) converted.insert(fileList[i]);
+        convertedCv.notify_all();
       }
 
-      cout << "Conversions complete" << endl << endl;
+      {
+        std::lock_guard<std::mutex> lock(convertedMutex);
+        cout << "Conversions complete (cache hits: " << cacheHits << ", misses: " << cacheMisses << ")" << endl << endl;
+      }
 
       // if (conversionFailure) return 1;
       // else return 0;
@@ -195,8 +254,6 @@ int main(int argc, char* argv[]) try {
     socket.shutdown(tcp::socket::shutdown_send, ec);
   };
 
-  asio::io_context ioc{/*concurrency_hint=*/1};
-  tcp::acceptor acceptor{ioc, {address, port}};
   for (;;) {
     auto socket = acceptor.accept(ioc);
     if (!socket.is_open()) break;
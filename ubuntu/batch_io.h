@@ -0,0 +1,484 @@
+/*
+// Batch conversion of many local .bin files, for the on-disk (Airflow) mode.
+// With thousands of small files the open/read/write/close syscalls cost more than the formatting, so where the kernel
+// supports it the files go through io_uring: opens, reads and writes for up to batchSlots files are queued together and
+// submitted in one syscall, reads land in registered buffers, and csv writes complete in the background while the next
+// file is decoded. Without io_uring (old kernel or headers, gVisor, io_uring disabled) a pool of threads runs
+// convertFile instead. The ring is driven with raw syscalls, so there's no liburing dependency
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "csv_conv2.h"
+#include "trace.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// Added in 5.6, the same release as the openat, close and write opcodes and the opcode probe we rely on
+#ifdef IORING_FEAT_RW_CUR_POS
+#define CSV_HAVE_IO_URING 1
+#endif
+#endif
+
+enum class BatchBackend { automatic, uring, threads, serial };
+
+inline const char* backendName(BatchBackend backend) {
+  switch (backend) {
+    case BatchBackend::uring: return "io_uring";
+    case BatchBackend::threads: return "threads";
+    case BatchBackend::serial: return "serial";
+    default: return "auto";
+  }
+}
+
+// Files in flight at once, and the size of each one's registered read buffer
+const unsigned batchSlots = 64;
+const size_t batchBufferSize = 64 * 1024;
+
+inline void convertFilesThreads(const vector<string>& binFiles, char delim, vector<int>& results) {
+  trace::Scope batchSpan("batch_threads");
+
+  std::atomic<size_t> next{0};
+  unsigned nThreads = std::max(1u, std::min<unsigned>(std::thread::hardware_concurrency() * 2, binFiles.size()));
+  vector<thread> workers;
+  for (unsigned t = 0; t < nThreads; t++) {
+    workers.emplace_back([&] {
+      for (size_t i = next++; i < binFiles.size(); i = next++) {
+        results[i] = convertFile(binFiles[i], delim);
+      }
+    });
+  }
+  for (auto& w : workers) w.join();
+}
+
+#ifdef CSV_HAVE_IO_URING
+
+// Minimal io_uring: one submission and one completion queue mapped from the kernel
+class Uring {
+ public:
+  explicit Uring(unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd_ = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd_ < 0) return;
+
+    sqRingSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) return;
+    cqRing_ = single ? sqRing_
+                     : mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cqRing_ == MAP_FAILED) return;
+    sqesSize_ = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return;
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sqRing_);
+    sqHead_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sqTail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sqMask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sqArray_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    sqEntries_ = p.sq_entries;
+    localTail_ = *sqTail_;
+
+    char* cq = static_cast<char*>(cqRing_);
+    cqHead_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cqMask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    ok_ = true;
+  }
+
+  ~Uring() {
+    if (sqes_ != nullptr) munmap(sqes_, sqesSize_);
+    if (cqRing_ != nullptr && cqRing_ != MAP_FAILED && cqRing_ != sqRing_) munmap(cqRing_, cqRingSize_);
+    if (sqRing_ != nullptr && sqRing_ != MAP_FAILED) munmap(sqRing_, sqRingSize_);
+    if (fd_ >= 0) close(fd_);
+  }
+
+  Uring(const Uring&) = delete;
+  Uring& operator=(const Uring&) = delete;
+
+  bool ok() const { return ok_; }
+
+  // True if the kernel implements every one of these opcodes
+  bool supports(std::initializer_list<int> opcodes) {
+    const unsigned maxOps = 256;
+    std::vector<char> mem(sizeof(io_uring_probe) + maxOps * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(mem.data());
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, maxOps) < 0) return false;
+    for (int op : opcodes) {
+      if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+    }
+    return true;
+  }
+
+  // Fails on kernels that charge registered buffers to a small RLIMIT_MEMLOCK; plain reads still work then
+  bool registerBuffers(const std::vector<iovec>& buffers) {
+    return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) == 0;
+  }
+
+  // Next free submission entry, zeroed. Only queued locally until submit(). nullptr if the queue is full and
+  // submitting it to make room failed, since the kernel hasn't consumed the entry we'd hand out
+  io_uring_sqe* sqe() {
+    if (localTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_ && submit(0) < 0) return nullptr;
+    if (localTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_) return nullptr;
+    unsigned index = localTail_ & sqMask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray_[index] = index;
+    localTail_++;
+    return sqe;
+  }
+
+  // Hands every queued entry to the kernel, then waits until at least waitFor completions are available
+  int submit(unsigned waitFor) {
+    __atomic_store_n(sqTail_, localTail_, __ATOMIC_RELEASE);
+    unsigned toSubmit = localTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    for (;;) {
+      int ret = syscall(__NR_io_uring_enter, fd_, toSubmit, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0,
+                        nullptr, 0);
+      if (ret >= 0 || errno != EINTR) return ret;
+    }
+  }
+
+  // Blocks until a completion is available, without submitting anything
+  int wait() {
+    for (;;) {
+      int ret = syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (ret >= 0 || errno != EINTR) return ret;
+    }
+  }
+
+  bool peek(io_uring_cqe& cqe) {
+    unsigned head = *cqHead_;
+    if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) return false;
+    cqe = cqes_[head & cqMask_];
+    __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+    reaped_++;
+    return true;
+  }
+
+  // Entries the kernel has taken whose completions haven't been peeked yet. Until this is 0 the kernel may still read
+  // from or write to their buffers
+  unsigned inFlight() const { return __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) - reaped_; }
+
+ private:
+  int fd_ = -1;
+  bool ok_ = false;
+  void* sqRing_ = nullptr;
+  void* cqRing_ = nullptr;
+  size_t sqRingSize_ = 0, cqRingSize_ = 0, sqesSize_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  unsigned *sqHead_ = nullptr, *sqTail_ = nullptr, *sqArray_ = nullptr;
+  unsigned sqMask_ = 0, sqEntries_ = 0, localTail_ = 0, reaped_ = 0;
+  unsigned *cqHead_ = nullptr, *cqTail_ = nullptr;
+  unsigned cqMask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+};
+
+// Returns false, having done nothing, if io_uring can't be used here. If the ring stops working part way through, the
+// files it hadn't finished are converted by the thread pool instead
+inline bool convertFilesUring(const vector<string>& binFiles, char delim, vector<int>& results) {
+  // Completions we don't wait on (closing a bin once it's read, clean-up after an error) carry this tag
+  const uint64_t untracked = ~uint64_t(0);
+
+  Uring ring(batchSlots * 2);
+  if (!ring.ok() || !ring.supports({IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_WRITE,
+                                    IORING_OP_CLOSE})) {
+    return false;
+  }
+
+  trace::Scope batchSpan("batch_uring");
+
+  vector<char> bufferMemory(batchSlots * batchBufferSize);
+  vector<iovec> buffers(batchSlots);
+  for (unsigned s = 0; s < batchSlots; s++) {
+    buffers[s].iov_base = bufferMemory.data() + s * batchBufferSize;
+    buffers[s].iov_len = batchBufferSize;
+  }
+  bool fixed = ring.registerBuffers(buffers);
+
+  enum Stage { openBin, readBin, openCsv, writeCsv, closeCsv };
+  struct Slot {
+    size_t file;
+    Stage stage;
+    int fd = -1;
+    string csvName;
+    string data; // the bin file, as read so far
+    string out;  // the formatted csv
+    size_t written;
+  };
+  vector<Slot> slots(batchSlots);
+  vector<char> done(binFiles.size(), 0); // succeeded or failed; either way results holds the answer
+  size_t next = 0;
+  unsigned active = 0;
+  unsigned untrackedInFlight = 0;
+  bool broken = false; // the ring stopped taking submissions; the thread pool finishes the job
+
+  auto closeUntracked = [&](int fd) {
+    io_uring_sqe* sqe = ring.sqe();
+    if (sqe == nullptr) {
+      close(fd);
+      broken = true;
+      return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = untracked;
+    untrackedInFlight++;
+  };
+
+  auto queueRead = [&](unsigned s) {
+    io_uring_sqe* sqe = ring.sqe();
+    if (sqe == nullptr) {
+      broken = true;
+      return;
+    }
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = slots[s].fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffers[s].iov_base);
+    sqe->len = batchBufferSize;
+    sqe->off = slots[s].data.size();
+    if (fixed) sqe->buf_index = s;
+    sqe->user_data = s;
+  };
+
+  auto queueWrite = [&](unsigned s) {
+    io_uring_sqe* sqe = ring.sqe();
+    if (sqe == nullptr) {
+      broken = true;
+      return;
+    }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = slots[s].fd;
+    sqe->addr = reinterpret_cast<uint64_t>(slots[s].out.data() + slots[s].written);
+    sqe->len = slots[s].out.size() - slots[s].written;
+    sqe->off = slots[s].written;
+    sqe->user_data = s;
+  };
+
+  auto queueOpen = [&](unsigned s, const string& path, int flags) {
+    io_uring_sqe* sqe = ring.sqe();
+    if (sqe == nullptr) {
+      broken = true;
+      return;
+    }
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uint64_t>(path.c_str());
+    sqe->len = 0666;
+    sqe->open_flags = flags | O_CLOEXEC;
+    sqe->user_data = s;
+  };
+
+  // Gives the slot the next file, or retires it when there are none left
+  auto startNext = [&](unsigned s) {
+    if (next == binFiles.size()) {
+      active--;
+      return;
+    }
+    Slot& slot = slots[s];
+    slot.file = next++;
+    slot.stage = openBin;
+    slot.fd = -1;
+    slot.data.clear();
+    slot.out.clear();
+    slot.written = 0;
+    queueOpen(s, binFiles[slot.file], O_RDONLY);
+  };
+
+  auto fail = [&](unsigned s) {
+    if (slots[s].fd >= 0) closeUntracked(slots[s].fd);
+    slots[s].fd = -1;
+    results[slots[s].file] = 1;
+    done[slots[s].file] = 1;
+    startNext(s);
+  };
+
+  for (unsigned s = 0; s < batchSlots && next < binFiles.size(); s++) {
+    active++;
+    startNext(s);
+  }
+
+  // Consecutive submits the kernel turned away as busy. Give up on the ring if it never recovers
+  const unsigned maxBusy = 1000;
+  unsigned busy = 0;
+
+  while ((active > 0 || untrackedInFlight > 0) && !broken) {
+    if (ring.submit(1) < 0) {
+      // EAGAIN and EBUSY mean the kernel is short of memory or the completion queue is full: reap what has completed
+      // below, then try again
+      if ((errno == EAGAIN || errno == EBUSY) && ++busy < maxBusy) std::this_thread::yield();
+      else {
+        // Shouldn't happen once the probe passed
+        std::cerr << "io_uring_enter failed: " << strerror(errno) << "\n";
+        broken = true;
+        break;
+      }
+    }
+    else busy = 0;
+
+    io_uring_cqe cqe;
+    while (ring.peek(cqe)) {
+      if (cqe.user_data == untracked) {
+        untrackedInFlight--;
+        continue;
+      }
+      unsigned s = cqe.user_data;
+      Slot& slot = slots[s];
+      if (cqe.res < 0) {
+        fail(s);
+        continue;
+      }
+
+      switch (slot.stage) {
+        case openBin:
+          slot.fd = cqe.res;
+          slot.stage = readBin;
+          queueRead(s);
+          break;
+
+        case readBin:
+          // Keep reading until the kernel returns nothing: a short read isn't the end on FUSE or NFS
+          if (cqe.res > 0) {
+            slot.data.append(static_cast<char*>(buffers[s].iov_base), cqe.res);
+            queueRead(s);
+            break;
+          }
+
+          // At the end. The bin is closed in the background while we format
+          closeUntracked(slot.fd);
+          slot.fd = -1;
+          {
+            trace::Scope span("format", binFiles[slot.file]);
+            vector<block_t> blocks;
+            decodeBuffer(slot.data.data(), slot.data.size(), blocks);
+            std::ostringstream csv;
+            writeHeader(csv, delim);
+            writeBlocks(csv, blocks, 0, blocks.size(), delim);
+            slot.out = std::move(csv).str();
+          }
+          slot.csvName = csvNameFor(binFiles[slot.file]);
+          slot.stage = openCsv;
+          queueOpen(s, slot.csvName, O_WRONLY | O_CREAT | O_TRUNC);
+          break;
+
+        case openCsv:
+          slot.fd = cqe.res;
+          slot.stage = writeCsv;
+          queueWrite(s);
+          break;
+
+        case writeCsv:
+          slot.written += cqe.res;
+          if (slot.written < slot.out.size()) {
+            queueWrite(s);
+            break;
+          }
+          slot.stage = closeCsv;
+          {
+            io_uring_sqe* sqe = ring.sqe();
+            if (sqe == nullptr) {
+              broken = true;
+              break;
+            }
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = slot.fd;
+            sqe->user_data = s;
+          }
+          slot.fd = -1;
+          break;
+
+        case closeCsv:
+          results[slot.file] = 0;
+          done[slot.file] = 1;
+          startNext(s);
+          break;
+      }
+    }
+  }
+
+  if (broken) {
+    std::cerr << "io_uring stopped taking submissions, falling back to threads\n";
+
+    // Wait out everything the kernel still has, so nothing lands in the buffers or csv files after we move on.
+    // Opens that complete now hand back an fd to close; a csv whose close completes is finished
+    while (ring.inFlight() > 0) {
+      io_uring_cqe cqe;
+      if (!ring.peek(cqe)) {
+        if (ring.wait() < 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        continue;
+      }
+      if (cqe.user_data == untracked) continue;
+      Slot& slot = slots[cqe.user_data];
+      if (cqe.res < 0) continue;
+      if (slot.stage == openBin || slot.stage == openCsv) slot.fd = cqe.res;
+      else if (slot.stage == closeCsv) {
+        results[slot.file] = 0;
+        done[slot.file] = 1;
+      }
+    }
+    for (unsigned s = 0; s < batchSlots; s++) {
+      if (slots[s].fd >= 0) close(slots[s].fd);
+    }
+
+    // Keep what's finished and hand the rest to the thread pool. Nothing is writing their csvs any more, so a
+    // half-written one is simply truncated and written again
+    vector<string> remaining;
+    vector<size_t> index;
+    for (size_t i = 0; i < binFiles.size(); i++) {
+      if (!done[i]) {
+        remaining.push_back(binFiles[i]);
+        index.push_back(i);
+      }
+    }
+    vector<int> remainingResults(remaining.size(), 1);
+    convertFilesThreads(remaining, delim, remainingResults);
+    for (size_t r = 0; r < remaining.size(); r++) results[index[r]] = remainingResults[r];
+  }
+
+  return true;
+}
+
+#endif // CSV_HAVE_IO_URING
+
+// Converts every file, with the same output as calling convertFile on each. results[i] is convertFile's return value
+// for binFiles[i]. Returns the backend actually used: asking for io_uring where it's unavailable gets the thread pool
+inline BatchBackend convertFiles(const vector<string>& binFiles, char delim, vector<int>& results,
+                                 BatchBackend backend = BatchBackend::automatic) {
+  results.assign(binFiles.size(), 1);
+
+  if (backend == BatchBackend::serial) {
+    for (size_t i = 0; i < binFiles.size(); i++) results[i] = convertFile(binFiles[i], delim);
+    return backend;
+  }
+
+#ifdef CSV_HAVE_IO_URING
+  if (backend == BatchBackend::automatic || backend == BatchBackend::uring) {
+    if (convertFilesUring(binFiles, delim, results)) return BatchBackend::uring;
+  }
+#endif
+
+  convertFilesThreads(binFiles, delim, results);
+  return BatchBackend::threads;
+}
@@ -0,0 +1,191 @@
+/*
+// Local cache of converted output, so a warm instance doesn't download and convert the same object twice.
+// Entries are keyed by object name + generation + output format, and live in their own directory under the cache dir:
+//   <dir>/<hash of key>/index   - the key on the first line, then the entry's file names in upload order
+//   <dir>/<hash of key>/<files>
+// Entries from a previous run of the process are picked up again on first use, so constructing the cache touches no
+// disk and doesn't hold up startup. Least recently used entries are removed once the total size goes over the limit
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+class ConversionCache {
+ public:
+  ConversionCache(std::string const& dir, std::uintmax_t maxBytes) : dir_(dir), maxBytes_(maxBytes) {}
+
+  // Returns the entry's files if it's cached, and marks it as most recently used
+  std::optional<std::vector<std::string>> lookup(std::string const& key) {
+    std::lock_guard<std::mutex> lock(mu_);
+    load();
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      misses_++;
+      return std::nullopt;
+    }
+    hits_++;
+    lru_.splice(lru_.end(), lru_, it->second);
+    boost::system::error_code ec;
+    boost::filesystem::last_write_time(it->second->path, std::time(nullptr), ec);
+    return it->second->files;
+  }
+
+  // Moves freshly converted files into the cache under key, replacing any older entry, and returns their new paths.
+  // The new entry is never evicted by its own insertion, so the returned files stay valid until the next insert
+  std::vector<std::string> insert(std::string const& key, std::vector<std::string> const& files) {
+    namespace fs = boost::filesystem;
+    std::lock_guard<std::mutex> lock(mu_);
+    load();
+
+    Entry entry;
+    entry.key = key;
+    entry.path = fs::path(dir_) / hashKey(key);
+
+    // Drop the older version of this key, or another key that hashes to the same directory
+    for (auto it = lru_.begin(); it != lru_.end(); ++it) {
+      if (it->path == entry.path) {
+        remove(it);
+        break;
+      }
+    }
+    fs::remove_all(entry.path);
+    fs::create_directories(entry.path);
+
+    std::ofstream index((entry.path / "index").string());
+    index << key << "\n";
+    for (auto const& file : files) {
+      fs::path to = entry.path / fs::path(file).filename();
+      move(file, to);
+      index << to.filename().string() << "\n";
+      entry.files.push_back(to.string());
+      entry.bytes += fs::file_size(to);
+    }
+    index.close();
+
+    std::vector<std::string> result = entry.files;
+    auto it = add(std::move(entry));
+    evict(&*it);
+    return result;
+  }
+
+  long hits() const { return hits_; }
+  long misses() const { return misses_; }
+  // 0 until the first lookup or insert has loaded the cache. Lock-free, like the counters, so /metrics never waits on a
+  // load or insert
+  std::uintmax_t bytes() const { return bytes_; }
+
+ private:
+  struct Entry {
+    std::string key;
+    boost::filesystem::path path;
+    std::vector<std::string> files;
+    std::uintmax_t bytes = 0;
+  };
+
+  // Creates the cache dir and reloads entries left by an earlier run, oldest first, so they are evicted first.
+  // Called with mu_ held; only the first call does anything
+  void load() {
+    namespace fs = boost::filesystem;
+    if (loaded_) return;
+    loaded_ = true;
+    fs::create_directories(dir_);
+
+    std::multimap<std::time_t, fs::path> found;
+    for (fs::directory_iterator it(dir_), end; it != end; ++it) {
+      if (fs::is_directory(it->path())) found.emplace(fs::last_write_time(it->path()), it->path());
+    }
+    for (auto const& f : found) {
+      Entry entry;
+      if (readEntry(f.second, entry)) add(std::move(entry));
+      else fs::remove_all(f.second); // half-written or from an older layout
+    }
+    evict(nullptr);
+  }
+
+  // FNV-1a. A collision only costs a miss: the newer key takes over the directory
+  static std::string hashKey(std::string const& key) {
+    std::uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : key) {
+      h ^= c;
+      h *= 1099511628211ull;
+    }
+    char buf[17];
+    std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(h));
+    return buf;
+  }
+
+  static bool readEntry(boost::filesystem::path const& path, Entry& entry) {
+    namespace fs = boost::filesystem;
+    std::ifstream index((path / "index").string());
+    if (!std::getline(index, entry.key) || entry.key.empty()) return false;
+    entry.path = path;
+    std::string name;
+    while (std::getline(index, name)) {
+      fs::path file = path / name;
+      boost::system::error_code ec;
+      auto size = fs::file_size(file, ec);
+      if (ec) return false;
+      entry.files.push_back(file.string());
+      entry.bytes += size;
+    }
+    return !entry.files.empty();
+  }
+
+  // Rename, falling back to copy when the cache dir is on another filesystem
+  static void move(std::string const& from, boost::filesystem::path const& to) {
+    namespace fs = boost::filesystem;
+    boost::system::error_code ec;
+    fs::rename(from, to, ec);
+    if (!ec) return;
+    fs::copy_file(from, to);
+    fs::remove(from);
+  }
+
+  std::list<Entry>::iterator add(Entry entry) {
+    bytes_ += entry.bytes;
+    auto it = lru_.insert(lru_.end(), std::move(entry));
+    index_[it->key] = it;
+    return it;
+  }
+
+  void remove(std::list<Entry>::iterator it) {
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(it->path, ec);
+    if (ec) std::cerr << "Failed to remove cache entry " << it->path << ": " << ec.message() << "\n";
+    bytes_ -= it->bytes;
+    index_.erase(it->key);
+    lru_.erase(it);
+  }
+
+  // Drops least recently used entries until under the limit, except keep
+  void evict(Entry const* keep) {
+    for (auto it = lru_.begin(); bytes_ > maxBytes_ && it != lru_.end();) {
+      auto next = std::next(it);
+      if (&*it != keep) remove(it);
+      it = next;
+    }
+  }
+
+  std::string dir_;
+  std::uintmax_t maxBytes_;
+  std::mutex mu_;
+  bool loaded_ = false;
+  std::list<Entry> lru_; // least recently used first
+  std::map<std::string, std::list<Entry>::iterator> index_;
+  std::atomic<std::uintmax_t> bytes_{0}; // only written with mu_ held
+  std::atomic<long> hits_{0};
+  std::atomic<long> misses_{0};
+};
@@ -13,6 +13,11 @@
 #include <stdint.h>
 #include <limits.h>
 #include <unistd.h>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+
+#include "trace.h"
 
 // Get the common structs used for storing motion data
 // All the data that we read and store every timestep. 30 bytes
@@ -64,87 +69,211 @@ void printVector(vector<string> fileList) {
   cout << endl;
 }
 
-int convertFile(string binFileName, char delim){
+// Swaps the extension of the file name for .csv, or adds one. Dots in the directories ("./folder", "d.v2/") are left alone
+string csvNameFor(string binFileName) {
+  size_t slash = binFileName.rfind('/');
+  size_t start = slash == string::npos ? 0 : slash + 1;
+  size_t dot = binFileName.rfind('.');
+  if (dot == string::npos || dot < start) dot = binFileName.size();
+  return binFileName.substr(0, dot) + ".csv";
+}
+
+// Reads every block up to the first empty one. Returns 1 if the file can't be opened
+int decodeFile(const string& binFileName, vector<block_t>& blocks){
 
   ifstream binFile;
-  ofstream csvFile, csvTimeFile;
-  streampos begin,current;
-  data_t datapoint;
   block_t block;
-  int fileSize, progress, i, packetSize;
-  int state = 1;
-  long int counter = 0;
-  string csvFileName;
 
-  // Below, we will need the absolute path to the current working dir
-//   string path = getexepath();
-
-  // Open bin file
-  // Append the dir path to the relative file name picked up earlier, but first chop off the initial '.'
-//   binFileName = path + binFileName.erase(0,1);
+  {
+    trace::Scope span("open", binFileName);
+    binFile.open(binFileName.c_str(), ios::binary);  // change required on mac compiler
+    if (binFile.fail()){
+      return 1;
+    };
+  }
 
-  binFile.open(binFileName.c_str(), ios::binary);  // change required on mac compiler
+  trace::Scope span("decode", binFileName);
+  blocks.reserve(getSize(binFile) / sizeof(block_t));
 
-  if (binFile.fail()){
-    return 1;
-  };
+  while( binFile.read((char*) &block, 512) )
+  {
+    // Break is reached end of block
+    if (block.count == 0) {
+      break;
+    }
+    blocks.push_back(block);
+  }
+  binFile.close();
 
-  // For progress tracking
-  packetSize = sizeof(block);
-  fileSize = getSize(binFile);
-  begin = binFile.tellg();
+  return 0;
+}
 
-  // Create name for csv file
-  csvFileName = binFileName;
+// Same as decodeFile, for a file that has already been read into memory
+void decodeBuffer(const char* data, size_t size, vector<block_t>& blocks){
+  block_t block;
 
-  csvFileName.replace( csvFileName.find(".")+1, csvFileName.find(".")+4, "csv");
-  csvFile.open(csvFileName.c_str()); // change required on mac compiler
-  if (csvFile.fail()){
-    return 1;
-  };
+  blocks.reserve(size / sizeof(block_t));
+  for (size_t offset = 0; offset + 512 <= size; offset += 512) {
+    memcpy(&block, data + offset, 512);
+    // Break is reached end of block
+    if (block.count == 0) {
+      break;
+    }
+    blocks.push_back(block);
+  }
+}
 
+void writeHeader(ostream& csvFile, char delim){
   csvFile << "acc_x_left" << delim << "acc_y_left" << delim << "acc_z_left" << delim << "gyr_x_left" << delim << "gyr_y_left" << delim << "gyr_z_left" << delim;
   csvFile << "acc_x_right" << delim << "acc_y_right" << delim << "acc_z_right" << delim << "gyr_x_right" << delim << "gyr_y_right" << delim << "gyr_z_right" << delim;
   csvFile << "prediction" <<delim;
   csvFile << "FSR" << delim <<  "time_delta" << delim;
   csvFile << "left_acc_mag_status" << delim <<  "left_gyro_status" << delim << "right_acc_mag_status" << delim <<  "right_gyro_status" << endl;
-  progress = fileSize/(10*packetSize);
+}
+
+// Writes the rows of one block
+void writeBlock(ostream& csvFile, const block_t& block, char delim){
+  data_t datapoint;
+
+  for (int i = 0; i < block.count; i++) {
+    datapoint = block.data[i];
+
+    csvFile << datapoint.imuData[0] << delim << datapoint.imuData[1] << delim << datapoint.imuData[2] << delim;
+    csvFile << datapoint.imuData[3] << delim << datapoint.imuData[4] << delim << datapoint.imuData[5] << delim;
+    csvFile << datapoint.imuData[6] << delim << datapoint.imuData[7] << delim << datapoint.imuData[8] << delim;
+    csvFile << datapoint.imuData[9] << delim << datapoint.imuData[10] << delim << datapoint.imuData[11] << delim;
+
+    csvFile << (int) datapoint.prediction << delim;
+
+    //Need to convert time (uint8_t) to int for iostream: do this with +
+    csvFile << (int) datapoint.FSR << delim << +datapoint.time << delim; 
+
+    csvFile << (int) datapoint.imuStatus[0] << delim << (int) datapoint.imuStatus[1] << delim;
+    csvFile << (int) datapoint.imuStatus[2] << delim << (int) datapoint.imuStatus[3] << delim <<endl;
+  }
+}
+
+// Writes the rows of blocks [first, last)
+void writeBlocks(ostream& csvFile, const vector<block_t>& blocks, size_t first, size_t last, char delim){
+  for (size_t b = first; b < last; b++) {
+    writeBlock(csvFile, blocks[b], delim);
+  }
+}
+
+int convertFile(string binFileName, char delim){
+
+  ifstream binFile;
+  ofstream csvFile;
+  block_t block;
+  string csvFileName = csvNameFor(binFileName);
+
+  trace::Scope convertSpan("convert", binFileName);
 
-  while( binFile.read((char*) &block, 512) )
   {
-    counter++;
-    if (counter > progress){
-      progress = progress + fileSize/(10*packetSize);
-      state++;
-    }
+    trace::Scope span("open", binFileName);
 
-//     // Break is reached end of block
-    if (block.count == 0) {
+    // Open bin file
+    binFile.open(binFileName.c_str(), ios::binary);  // change required on mac compiler
+    if (binFile.fail()){
+      return 1;
+    };
+
+    csvFile.open(csvFileName.c_str()); // change required on mac compiler
+    if (csvFile.fail()){
+      return 1;
+    };
+  }
+
+  // Blocks are still streamed one at a time, so reading and formatting interleave. Their times are summed over the loop
+  // and recorded as two back-to-back spans, decode then format
+  typedef std::chrono::steady_clock clock;
+  uint64_t loopStart = trace::nowMicros();
+  clock::duration decodeTime{0}, formatTime{0};
+
+  writeHeader(csvFile, delim);
+  for (;;) {
+    auto t0 = clock::now();
+    bool read = (bool) binFile.read((char*) &block, 512);
+    auto t1 = clock::now();
+    decodeTime += t1 - t0;
+
+    // Break is reached end of block
+    if (!read || block.count == 0) {
       break;
     }
 
-    
     // Write to file
-    for (int i = 0; i < block.count; i++) {
-      datapoint = block.data[i];
+    writeBlock(csvFile, block, delim);
+    formatTime += clock::now() - t1;
+  }
+  binFile.close();
 
-      csvFile << datapoint.imuData[0] << delim << datapoint.imuData[1] << delim << datapoint.imuData[2] << delim;
-      csvFile << datapoint.imuData[3] << delim << datapoint.imuData[4] << delim << datapoint.imuData[5] << delim;
-      csvFile << datapoint.imuData[6] << delim << datapoint.imuData[7] << delim << datapoint.imuData[8] << delim;
-      csvFile << datapoint.imuData[9] << delim << datapoint.imuData[10] << delim << datapoint.imuData[11] << delim;
+  uint64_t decodeMicros = std::chrono::duration_cast<std::chrono::microseconds>(decodeTime).count();
+  uint64_t formatMicros = std::chrono::duration_cast<std::chrono::microseconds>(formatTime).count();
+  trace::record("decode", binFileName.c_str(), loopStart, loopStart + decodeMicros);
+  trace::record("format", binFileName.c_str(), loopStart + decodeMicros, loopStart + decodeMicros + formatMicros);
 
-      csvFile << (int) datapoint.prediction << delim;
+  {
+    trace::Scope span("flush", csvFileName);
+    csvFile.close();
+    if (csvFile.fail()){
+      return 1;
+    };
+  }
 
-      //Need to convert time (uint8_t) to int for iostream: do this with +
-      csvFile << (int) datapoint.FSR << delim << +datapoint.time << delim; 
+  return 0;
+}
 
-      csvFile << (int) datapoint.imuStatus[0] << delim << (int) datapoint.imuStatus[1] << delim;
-      csvFile << (int) datapoint.imuStatus[2] << delim << (int) datapoint.imuStatus[3] << delim <<endl;
-    }
+// Converts into nParts csv files, formatted in parallel, which concatenate to exactly what convertFile writes.
+// Each part gets a contiguous range of blocks; only the first carries the header. Part file names go in partNames
+int convertFileParts(string binFileName, char delim, int nParts, vector<string>& partNames){
+
+  vector<block_t> blocks;
+  string csvFileName = csvNameFor(binFileName);
+
+  trace::Scope convertSpan("convert", binFileName);
+
+  if (decodeFile(binFileName, blocks) != 0){
+    return 1;
+  };
+
+  // Never more parts than blocks, and always at least one so an empty file still gets its header
+  nParts = std::max(1, std::min<int>(nParts, blocks.size()));
+
+  partNames.clear();
+  for (int p = 0; p < nParts; p++) {
+    partNames.push_back(csvFileName + ".part" + to_string(p));
   }
 
-    binFile.close();
-    csvTimeFile.close();
+  vector<int> results(nParts, 0);
+  vector<thread> workers;
+  for (int p = 0; p < nParts; p++) {
+    workers.emplace_back([&, p] {
+      // Even split: part sizes differ by at most one block, and none is empty
+      size_t first = p * blocks.size() / nParts;
+      size_t last = (p + 1) * blocks.size() / nParts;
+
+      ofstream csvFile(partNames[p].c_str());
+      if (csvFile.fail()){
+        results[p] = 1;
+        return;
+      };
 
-    return 0;
+      {
+        trace::Scope span("format", partNames[p]);
+        if (p == 0) writeHeader(csvFile, delim);
+        writeBlocks(csvFile, blocks, first, last, delim);
+      }
+
+      trace::Scope span("flush", partNames[p]);
+      csvFile.close();
+      if (csvFile.fail()) results[p] = 1;
+    });
+  }
+  for (auto& w : workers) w.join();
+
+  for (int p = 0; p < nParts; p++) {
+    if (results[p] != 0) return 1;
+  }
+  return 0;
 }
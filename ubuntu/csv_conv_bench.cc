@@ -0,0 +1,128 @@
+/*
+// Times the local batch conversion backends over many small files: ./csv_conv_bench [files=10000] [dir=/tmp/csv_conv_bench]
+// Every backend converts the same generated files, and its output is checked against the serial (ifstream/ofstream) path
+*/
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <boost/filesystem.hpp>
+
+#include "batch_io.h"
+
+namespace fs = boost::filesystem;
+
+// A small recording: 1 to 8 full blocks, then the empty block that ends the data
+void writeRecording(const string& name, std::mt19937& rng) {
+  block_t block;
+  memset(&block, 0, sizeof(block));
+
+  ofstream binFile(name.c_str(), ios::binary);
+  int nBlocks = 1 + rng() % 8;
+  for (int b = 0; b < nBlocks; b++) {
+    block.count = dataDim;
+    for (int d = 0; d < dataDim; d++) {
+      for (int k = 0; k < 12; k++) block.data[d].imuData[k] = rng();
+      block.data[d].FSR = rng();
+      block.data[d].time = rng();
+    }
+    binFile.write((char*) &block, 512);
+  }
+  block.count = 0;
+  binFile.write((char*) &block, 512);
+}
+
+void generate(const string& dir, size_t nFiles, vector<string>& fileList) {
+  std::mt19937 rng(42);
+
+  fs::remove_all(dir);
+  for (size_t i = 0; i < nFiles; i++) {
+    // Spread over subdirs, like the bucket layout
+    string sub = dir + "/" + to_string(i % 100);
+    fs::create_directories(sub);
+    string name = sub + "/rec" + to_string(i) + ".bin";
+    writeRecording(name, rng);
+    fileList.push_back(name);
+  }
+}
+
+// Relative paths and dotted directory names, as csv_conv_local is given them: each csv must land next to its bin.
+// Returns the number of files that didn't
+size_t checkRelativePaths(const string& dir) {
+  std::mt19937 rng(7);
+  string rel = "./" + fs::path(dir).filename().string() + ".rel";
+  vector<string> fileList = {rel + "/top.bin", rel + "/d.v2/rec.bin", rel + "/d.v2/noext"};
+
+  fs::remove_all(rel);
+  fs::create_directories(rel + "/d.v2");
+  for (const auto& name : fileList) writeRecording(name, rng);
+
+  const vector<string> expected = {rel + "/top.csv", rel + "/d.v2/rec.csv", rel + "/d.v2/noext.csv"};
+  size_t wrong = 0;
+  for (BatchBackend backend : {BatchBackend::serial, BatchBackend::threads, BatchBackend::uring}) {
+    for (const auto& name : expected) fs::remove(name);
+
+    vector<int> results;
+    convertFiles(fileList, ',', results, backend);
+    for (size_t i = 0; i < fileList.size(); i++) {
+      if (results[i] != 0 || !fs::exists(expected[i])) {
+        cout << backendName(backend) << ": " << fileList[i] << " not converted to " << expected[i] << endl;
+        wrong++;
+      }
+    }
+  }
+
+  fs::remove_all(rel);
+  return wrong;
+}
+
+void removeOutputs(const vector<string>& fileList) {
+  for (const auto& name : fileList) fs::remove(csvNameFor(name));
+}
+
+string readAll(const string& name) {
+  ifstream file(name.c_str(), ios::binary);
+  return string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+int main(int argc, char* argv[]) {
+  size_t nFiles = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+  string dir = argc > 2 ? argv[2] : "/tmp/csv_conv_bench";
+
+  vector<string> fileList;
+  generate(dir, nFiles, fileList);
+
+  // Reference output from the current path
+  vector<int> results;
+  convertFiles(fileList, ',', results, BatchBackend::serial);
+  vector<string> expected;
+  for (const auto& name : fileList) expected.push_back(readAll(csvNameFor(name)));
+
+  cout << nFiles << " files in " << dir << endl;
+  cout << std::left << std::setw(10) << "backend" << std::setw(12) << "ms" << "files/s" << endl;
+
+  int status = 0;
+  for (BatchBackend backend : {BatchBackend::serial, BatchBackend::threads, BatchBackend::uring}) {
+    removeOutputs(fileList);
+
+    auto start = std::chrono::steady_clock::now();
+    BatchBackend used = convertFiles(fileList, ',', results, backend);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    size_t wrong = 0;
+    for (size_t i = 0; i < fileList.size(); i++) {
+      if (results[i] != 0 || readAll(csvNameFor(fileList[i])) != expected[i]) wrong++;
+    }
+
+    cout << std::setw(10) << backendName(used) << std::setw(12) << std::fixed << std::setprecision(1) << ms
+         << std::setprecision(0) << nFiles / (ms / 1000) << (wrong ? "  MISMATCH: " + to_string(wrong) : "") << endl;
+    if (wrong) status = 1;
+  }
+
+  fs::remove_all(dir);
+
+  if (checkRelativePaths(dir) != 0) status = 1;
+  return status;
+}
@@ -0,0 +1,55 @@
+/*
+// Converts .bin files on local disk, as the original Airflow job did. Arguments are files or directories, which are
+// searched recursively: ./csv_conv_local [--backend=auto|uring|threads|serial] ./folder ./other/filename.bin
+// Returns 1 if conversion of any file fails, or if there are no files, so that airflow knows about it
+*/
+
+#include <cstring>
+#include <iostream>
+#include <boost/filesystem.hpp>
+
+#include "batch_io.h"
+
+int main(int argc, char* argv[]) try {
+  namespace fs = boost::filesystem;
+
+  BatchBackend backend = BatchBackend::automatic;
+  vector<string> fileList;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--backend=uring") backend = BatchBackend::uring;
+    else if (arg == "--backend=threads") backend = BatchBackend::threads;
+    else if (arg == "--backend=serial") backend = BatchBackend::serial;
+    else if (arg == "--backend=auto") backend = BatchBackend::automatic;
+    else if (fs::is_directory(arg)) {
+      for (fs::recursive_directory_iterator it(arg), end; it != end; ++it) {
+        if (fs::is_regular_file(it->path()) && it->path().extension() == ".bin") fileList.push_back(it->path().string());
+      }
+    }
+    else fileList.push_back(arg);
+  }
+
+  if (fileList.size() == 0) {
+    cout << "No files to convert" << endl;
+    return 1;
+  }
+
+  vector<int> results;
+  BatchBackend used = convertFiles(fileList, ',', results, backend);
+
+  int failures = 0;
+  for (size_t i = 0; i < fileList.size(); i++) {
+    if (results[i] != 0) {
+      cout << fileList[i] << " failed to convert" << endl;
+      failures++;
+    }
+  }
+  cout << fileList.size() - failures << " of " << fileList.size() << " files converted (" << backendName(used) << ")"
+       << endl;
+
+  return failures == 0 ? 0 : 1;
+} catch (std::exception const& ex) {
+  std::cerr << "Standard exception caught " << ex.what() << '\n';
+  return 1;
+}
@@ -1,9 +1,21 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <random>
 #include <thread>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
@@ -12,6 +24,8 @@
 #include <boost/filesystem.hpp>
 
 #include "csv_conv2.h" 
+#include "conversion_cache.h"
+#include "trace.h"
 #include "google/cloud/storage/client.h"
 
 namespace be = boost::beast;
@@ -48,7 +62,33 @@ po::variables_map parse_args(int& argc, char* argv[]) {
        "set listening address")
       //
       ("port", po::value<std::uint16_t>()->default_value(port),
-       "set listening port");
+       "set listening port")
+      //
+      ("threads", po::value<int>()->default_value(std::max(1u, std::thread::hardware_concurrency())),
+       "number of threads serving connections")
+      //
+      ("max-sessions", po::value<int>()->default_value(64),
+       "connections beyond this get a 503")
+      //
+      ("max-queued", po::value<int>()->default_value(4),
+       "conversion requests waiting or running beyond this get a 503")
+      //
+      ("timeout", po::value<int>()->default_value(30),
+       "seconds allowed for reading a request or writing a response")
+      //
+      ("composite-threshold", po::value<std::uintmax_t>()->default_value(16 << 20),
+       ".bin files of at least this many bytes are uploaded as a parallel composite")
+      //
+      ("composite-parts", po::value<int>()->default_value(8),
+       "number of parts for composite uploads (at most 32, 1 disables them)")
+      //
+      ("cache-dir", po::value<std::string>()->default_value("/r/cache"),
+       "where converted output is cached between requests")
+      //
+      // /r/cache is in memory on Cloud Run, alongside the downloads and composite parts, so keep well under the
+      // instance's memory limit (512 MiB by default)
+      ("cache-size", po::value<std::uintmax_t>()->default_value(std::uintmax_t(64) << 20),
+       "bytes of converted output to keep cached; must fit in the instance's memory if --cache-dir is tmpfs");
 
   po::variables_map vm;
   po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -59,12 +99,12 @@ po::variables_map parse_args(int& argc, char* argv[]) {
   return vm;
 }
 
-// Helper function that uses the GCP API and returns a vector of strings where each is the filename of a relevant file in the GCP bucket starting with the prefix given as an arg
-vector<string> ListObjectsWithPrefix(google::cloud::storage::Client client,
+// Helper function that uses the GCP API and returns the metadata (name, generation, size...) of every object in the GCP bucket starting with the prefix given as an arg
+vector<google::cloud::storage::ObjectMetadata> ListObjectsWithPrefix(google::cloud::storage::Client client,
                            std::vector<std::string> const& argv) {
   //! [list objects with prefix] [START storage_list_files_with_prefix]
-  vector<string> fileList;
   namespace gcs = google::cloud::storage;
+  vector<gcs::ObjectMetadata> fileList;
   [&fileList](gcs::Client client, std::string const& bucket_name,
      std::string const& bucket_prefix) {
     for (auto&& object_metadata :
@@ -72,7 +112,7 @@ vector<string> ListObjectsWithPrefix(google::cloud::storage::Client client,
       if (!object_metadata) {
         throw std::runtime_error(object_metadata.status().message());
       }
-        fileList.push_back(object_metadata->name());
+        fileList.push_back(*object_metadata);
 
       // std::cout << "bucket_name=" << object_metadata->bucket()
       //           << ", object_name=" << object_metadata->name() << "\n";
@@ -85,14 +125,15 @@ vector<string> ListObjectsWithPrefix(google::cloud::storage::Client client,
   return fileList;
 }
 
+// Downloads exactly the given generation, so what we convert matches what we listed
 void DownloadFile(google::cloud::storage::Client client,
-                  std::vector<std::string> const& argv) {
+                  std::vector<std::string> const& argv, std::int64_t generation) {
   //! [download file]
   namespace gcs = google::cloud::storage;
-  [](gcs::Client client, std::string const& bucket_name,
+  [generation](gcs::Client client, std::string const& bucket_name,
      std::string const& object_name, std::string const& file_name) {
     google::cloud::Status status =
-        client.DownloadToFile(bucket_name, object_name, file_name);
+        client.DownloadToFile(bucket_name, object_name, file_name, gcs::Generation(generation));
     if (!status.ok()) throw std::runtime_error(status.message());
 
     std::cout << "Downloaded " << object_name << " to " << file_name << "\n";
@@ -101,27 +142,115 @@ void DownloadFile(google::cloud::storage::Client client,
   (std::move(client), argv.at(0), argv.at(1), argv.at(2));
 }
 
-void UploadFile(google::cloud::storage::Client client,
+// Returns false if the object already exists, which IfGenerationMatch(0) refuses to overwrite
+bool UploadFile(google::cloud::storage::Client client,
                 std::vector<std::string> const& argv) {
   //! [upload file] [START storage_upload_file]
   namespace gcs = google::cloud::storage;
   using ::google::cloud::StatusOr;
-  [](gcs::Client client, std::string const& file_name,
+  return [](gcs::Client client, std::string const& file_name,
      std::string const& bucket_name, std::string const& object_name) {
     // Note that the client library automatically computes a hash on the
     // client-side to verify data integrity during transmission.
     StatusOr<gcs::ObjectMetadata> metadata = client.UploadFile(
         file_name, bucket_name, object_name, gcs::IfGenerationMatch(0));
+    if (!metadata && metadata.status().code() == google::cloud::StatusCode::kFailedPrecondition) {
+      std::cout << "Object " << object_name << " already exists in bucket " << bucket_name << "\n";
+      return false;
+    }
     if (!metadata) throw std::runtime_error(metadata.status().message());
 
     std::cout << "Uploaded " << file_name << " to object " << metadata->name()
               << " in bucket " << metadata->bucket() << "\n";
               // << "\nFull metadata: " << *metadata << "\n";
+    return true;
   }
   //! [upload file] [END storage_upload_file]
   (std::move(client), argv.at(0), argv.at(1), argv.at(2));
 }
 
+// Uploads the local part files as temporary objects in parallel, each with its own retries, then composes them into
+// object_name. The compose keeps IfGenerationMatch(0), so an existing output is never overwritten. Temporary objects
+// are removed whether or not it succeeds. Returns false, like UploadFile, if the output already exists
+bool UploadComposite(google::cloud::storage::Client client, std::vector<std::string> const& parts,
+                     std::string const& bucket_name, std::string const& object_name) {
+  namespace gcs = google::cloud::storage;
+  int const attempts = 3;
+
+  // The compose would refuse to overwrite an existing output anyway, so don't upload all the parts first to find out.
+  // Other errors are left for the uploads to report
+  google::cloud::StatusOr<gcs::ObjectMetadata> existing = client.GetObjectMetadata(bucket_name, object_name);
+  if (existing) {
+    std::cout << "Object " << object_name << " already exists in bucket " << bucket_name << "\n";
+    return false;
+  }
+
+  // A random suffix keeps the temporary objects of two instances converting the same file apart
+  std::random_device random;
+  char token[17];
+  std::snprintf(token, sizeof(token), "%08x%08x", random(), random());
+
+  std::vector<std::string> tmpNames;
+  for (std::size_t p = 0; p < parts.size(); p++) {
+    tmpNames.push_back(object_name + ".tmp-" + token + "-part" + std::to_string(p));
+  }
+
+  // A part that ends up without a generation failed all its attempts
+  std::vector<std::optional<std::int64_t>> generations(parts.size());
+  std::vector<std::thread> uploaders;
+  for (std::size_t p = 0; p < parts.size(); p++) {
+    uploaders.emplace_back([&, p] {
+      trace::Scope span("upload_part", tmpNames[p]);
+      for (int attempt = 1; attempt <= attempts; attempt++) {
+        // A retry may find its own earlier attempt landed after all, so these are allowed to overwrite
+        google::cloud::StatusOr<gcs::ObjectMetadata> metadata = client.UploadFile(parts[p], bucket_name, tmpNames[p]);
+        if (metadata) {
+          generations[p] = metadata->generation();
+          return;
+        }
+        std::cerr << "Upload of " << tmpNames[p] << " failed (attempt " << attempt << " of " << attempts
+                  << "): " << metadata.status().message() << "\n";
+      }
+    });
+  }
+  for (auto& u : uploaders) u.join();
+
+  std::string error;
+  bool exists = false;
+  std::vector<gcs::ComposeSourceObject> sources;
+  for (std::size_t p = 0; p < parts.size(); p++) {
+    if (!generations[p]) {
+      error = "upload of " + tmpNames[p] + " failed";
+      continue;
+    }
+    gcs::ComposeSourceObject source;
+    source.object_name = tmpNames[p];
+    source.generation = *generations[p];
+    sources.push_back(std::move(source));
+  }
+
+  if (error.empty()) {
+    trace::Scope span("compose", object_name);
+    google::cloud::StatusOr<gcs::ObjectMetadata> metadata =
+        client.ComposeObject(bucket_name, sources, object_name, gcs::IfGenerationMatch(0));
+    // Another instance may have written it since the check above
+    if (!metadata && metadata.status().code() == google::cloud::StatusCode::kFailedPrecondition) exists = true;
+    else if (!metadata) error = metadata.status().message();
+    else std::cout << "Uploaded " << parts.size() << " parts to object " << metadata->name()
+                   << " in bucket " << metadata->bucket() << "\n";
+  }
+
+  for (std::size_t p = 0; p < parts.size(); p++) {
+    if (!generations[p]) continue;
+    google::cloud::Status status = client.DeleteObject(bucket_name, tmpNames[p], gcs::Generation(*generations[p]));
+    if (!status.ok()) std::cerr << "Failed to delete " << tmpNames[p] << ": " << status.message() << "\n";
+  }
+
+  if (!error.empty()) throw std::runtime_error(error);
+  if (exists) std::cout << "Object " << object_name << " already exists in bucket " << bucket_name << "\n";
+  return !exists;
+}
+
 bool hasEnding (std::string const &fullString, std::string const &ending) {
   if (fullString.length() >= ending.length()) {
       return (0 == fullString.compare (fullString.length() - ending.length(), ending.length(), ending));
@@ -130,141 +259,424 @@ bool hasEnding (std::string const &fullString, std::string const &ending) {
   }
 }
 
+// Value of the query parameter name in a request target like "/?a=1&trace=1", or empty if it isn't there
+std::string queryParam(std::string const& target, std::string const& name) {
+  std::size_t query = target.find('?');
+  if (query == std::string::npos) return "";
 
+  std::vector<std::string> params;
+  boost::split(params, target.substr(query + 1), [](char c){return c == '&';});
+  for (auto const& param : params) {
+    std::size_t eq = param.find('=');
+    if (param.substr(0, eq) == name) return eq == std::string::npos ? "" : param.substr(eq + 1);
+  }
+  return "";
+}
 
-int main(int argc, char* argv[]) try {
-
-  // These should be passed in as args
-  std::string const bucket_name = "edd23232";
-  std::string const raw_data_dir = "unprocessed";
-  
-  // Create the first tier of the subdir structure (doesn't matter if it exists already)
-  boost::filesystem::create_directory(raw_data_dir);
-  
-  // Setup the GCloud stuff. We need two clients: one to read in the filenames, one to perform the downloads
-  namespace gcs = google::cloud::storage;
-  auto client = gcs::Client::CreateDefaultClient().value();
-  // vector<string> fileList = ListObjectsWithPrefix(client, {bucket_name, raw_data_dir});
+// Creates the storage client off the main thread so the port can be bound straight away on a cold start.
+// Credential discovery and the first token fetch happen here, and a first listing opens a TLS connection
+// that later requests reuse (copies of a gcs::Client share its connection pool)
+class StorageClientGate {
+ public:
+  void start(std::string const& bucket_name, std::string const& prefix) {
+    std::thread([this, bucket_name, prefix] {
+      namespace gcs = google::cloud::storage;
+      int const attempts = 5;
+      auto client = gcs::Client::CreateDefaultClient();
+      for (int attempt = 1, delay = 1; !client && attempt < attempts; attempt++, delay *= 2) {
+        std::cerr << "Failed to create Storage Client (attempt " << attempt << " of " << attempts << "), status="
+                  << client.status() << ", retrying in " << delay << "s\n";
+        std::this_thread::sleep_for(std::chrono::seconds(delay));
+        client = gcs::Client::CreateDefaultClient();
+      }
+      if (!client) {
+        // Nothing can be served without it. Exit, as startup failures always did, so the platform restarts us
+        std::cerr << "Failed to create Storage Client, status=" << client.status() << "\n";
+        std::exit(1);
+      }
 
-  // download client
-  google::cloud::StatusOr<gcs::Client> io_client = gcs::Client::CreateDefaultClient();
+      // Only the first page is fetched; a failure here is not fatal, the real request will retry
+      auto objects = client->ListObjects(bucket_name, gcs::Prefix(prefix));
+      auto first = objects.begin();
+      if (first != objects.end() && !*first) {
+        std::cerr << "Storage warm-up failed, status=" << first->status() << "\n";
+      }
 
-  if (!io_client) {
-    std::cerr << "Failed to create Storage Client, status=" << io_client.status() << "\n";
-    return 1;
+      std::lock_guard<std::mutex> lock(mu_);
+      client_.emplace(std::move(client));
+      cv_.notify_all();
+    }).detach();
   }
 
-  // After setting up, wait for a http request
-  po::variables_map vm = parse_args(argc, argv);
-
-  if (vm.count("help")) return 0;
+  bool ready() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return client_.has_value();
+  }
 
-  auto address = asio::ip::make_address(vm["address"].as<std::string>());
-  auto port = vm["port"].as<std::uint16_t>();
-  std::cout << "Listening on " << address << ":" << port << std::endl;
+  // Blocks until start() has finished, then returns the client. Creation is retried with backoff, and the process
+  // exits if it never succeeds, so this doesn't hand out a permanent error
+  google::cloud::StatusOr<google::cloud::storage::Client> wait() {
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [this] { return client_.has_value(); });
+    return *client_;
+  }
 
-  auto handle_session = [&client, &io_client, &bucket_name, &raw_data_dir](tcp::socket socket) {
-    auto report_error = [](be::error_code ec, char const* what) {
-      std::cerr << what << ": " << ec.message() << "\n";
-    };
+ private:
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::optional<google::cloud::StatusOr<google::cloud::storage::Client>> client_;
+};
+
+// Outputs from .bin files of at least threshold bytes are converted and uploaded in this many parts (at most 32,
+// the most GCS will compose in one call)
+struct CompositeUpload {
+  std::uintmax_t threshold;
+  int parts;
+};
+
+// Downloads every .bin under raw_data_dir, converts it and uploads the .csv. Returns the message for the response.
+// Converted output is kept in the cache, keyed by the object's generation, so an unchanged object is only downloaded
+// and converted once per instance
+std::string convertBucket(google::cloud::storage::Client client, std::string const& bucket_name,
+                          std::string const& raw_data_dir, CompositeUpload const& composite, ConversionCache& cache) {
+  // First, get the relevant files
+  vector<google::cloud::storage::ObjectMetadata> objects;
+  {
+    trace::Scope span("list", raw_data_dir);
+    objects = ListObjectsWithPrefix(client, {bucket_name, raw_data_dir});
+  }
+  vector<google::cloud::storage::ObjectMetadata> fileList;
+  for (auto const& object : objects) {
+    if (hasEnding (object.name(), ".bin")) fileList.push_back(object);
+  }
 
-    be::error_code ec;
-    for (;;) {
-      be::flat_buffer buffer;
-
-      // Arrival of a request releases the rest of the code
-      be::http::request<be::http::string_body> request;
-      be::http::read(socket, buffer, request, ec);
-      if (ec == be::http::error::end_of_stream) break;
-      if (ec) return report_error(ec, "read");
-
-      // First, get the relevant filenames
-      vector<string> fullFileList = ListObjectsWithPrefix(client, {bucket_name, raw_data_dir});
-      vector<string> fileList;
-
-      // For every filename, split the string to enable creation of the subdir structure. Use boost to make the dirs
-      for(int i=0; i < fullFileList.size(); i++) {
-        std::string base = raw_data_dir;
-        std::vector<std::string> results;
-        boost::split(results, fullFileList[i], [](char c){return c == '/';});
-
-        if (results.size() > 2) { // ie if not just 'unprocessed/*.bin'
-          for (int i(1); i < results.size()-1; i++) {
-            base += "/";
-            base +=  results[1];
-            boost::filesystem::create_directory(base);
-          }
+  char delim = ',';
+  std::string localPrefix = "/r/un";
+  int nFiles = fileList.size();
+  // Outputs that were already in the bucket and so weren't overwritten. They may be from an older generation of the .bin
+  int nPresent = 0;
+  cout << endl << endl << fileList.size() << " file(s) for conversion:"  << endl;
+
+  for(int i=0; i < fileList.size(); i++){
+    std::string const& name = fileList[i].name();
+    bool split = composite.parts > 1 && fileList[i].size() >= composite.threshold;
+    std::string key = bucket_name + "/" + name + "#" + std::to_string(fileList[i].generation()) + " delim=" + delim +
+                      " parts=" + std::to_string(split ? composite.parts : 1);
+
+    std::string abs_dl_path = "/r/" + name;
+    // Swap'.bin' for '.csv' and chop off '/r/un' to give the bucket filepath
+    std::string objectName = csvNameFor(abs_dl_path).substr(localPrefix.length());
+
+    auto outputs = cache.lookup(key);
+    if (outputs) cout << name << " (cached)" << endl;
+    else {
+      cout << name << endl;
+
+      // Split the string to enable creation of the subdir structure. Use boost to make the dirs
+      std::string base = raw_data_dir;
+      std::vector<std::string> results;
+      boost::split(results, name, [](char c){return c == '/';});
+
+      if (results.size() > 2) { // ie if not just 'unprocessed/*.bin'
+        for (int i(1); i < results.size()-1; i++) {
+          base += "/";
+          base +=  results[1];
+          boost::filesystem::create_directory(base);
         }
+      }
 
-        // Create absolute paths required by the converter, and download the files into these paths locally
-        if (hasEnding (fullFileList[i], ".bin")) {
-          std::string abs_dl_path = "/r/" + fullFileList[i];
-          // io_client->DownloadToFile(bucket_name, fullFileList[i], abs_dl_path);
-          DownloadFile(client, {bucket_name, fullFileList[i], abs_dl_path});
-          fileList.push_back(abs_dl_path);
-        }
+      // Download into the matching local path, and convert in place
+      {
+        trace::Scope span("download", name);
+        DownloadFile(client, {bucket_name, name, abs_dl_path}, fileList[i].generation());
       }
 
-      printVector(fileList);
-
-      // Conversion occurs in place so that a .csv accompanies every .bin in the directory tree
-      char delim = ',';
-      std::string localPrefix = "/r/un";
-      int nFiles = fileList.size();
-      for(int i=0; i < nFiles; i++){
-        if (convertFile(fileList[i], delim) == 0){
-
-          // Swap'.bin' for '.csv'
-          std::string fileToUpload = fileList[i].replace(fileList[i].length()-3, 3, "csv");
-          // Chop off '/r/un' to give the bucket filepath
-          std::string objectName = fileToUpload.substr(localPrefix.length(), fileToUpload.length() - localPrefix.length());
-          // Upload to the processed bucket
-          // io_client->UploadFile(fileToUpload, bucket_name, objectName);
-          UploadFile(client, {fileToUpload, bucket_name, objectName});
-        }
-        else {
-          cout << fileList[i] << " failed to convert" << endl;
-          nFiles --;
-        }
+      std::vector<std::string> produced;
+      int result;
+      if (split) result = convertFileParts(abs_dl_path, delim, composite.parts, produced);
+      else {
+        result = convertFile(abs_dl_path, delim);
+        produced.push_back(csvNameFor(abs_dl_path));
       }
+      boost::filesystem::remove(abs_dl_path);
 
-      cout << "Conversions complete" << endl << endl;
+      if (result != 0){
+        cout << name << " failed to convert" << endl;
+        for (auto const& file : produced) boost::filesystem::remove(file);
+        nFiles --;
+        continue;
+      }
+      outputs = cache.insert(key, produced);
+    }
 
-      // Send the response signalling completion
-      be::http::response<be::http::string_body> response{be::http::status::ok, request.version()};
-      response.set(be::http::field::server, BOOST_BEAST_VERSION_STRING);
-      response.set(be::http::field::content_type, "text/plain");
-      response.keep_alive(request.keep_alive());
+    // Upload to the processed bucket. An output that is already there, e.g. from an earlier request, isn't an error
+    // but is reported separately, since it isn't overwritten; any other upload error fails just this file
+    trace::Scope span("upload", objectName);
+    try {
+      bool uploaded;
+      if (outputs->size() > 1) uploaded = UploadComposite(client, *outputs, bucket_name, objectName);
+      else uploaded = UploadFile(client, {outputs->front(), bucket_name, objectName});
+      if (!uploaded) nPresent++;
+    } catch (std::exception const& e) {
+      cout << name << " failed to upload: " << e.what() << endl;
+      nFiles --;
+    }
+  }
+  cout << endl;
+
+  cout << "Conversions complete" << endl << endl;
+
+  // Success if none of the requested conversions failed
+  std::string msg;
+  if (nFiles == fileList.size()) msg = "Success: ";
+  else msg = "Error: only ";
+  msg += std::to_string(nFiles);
+  msg += " of ";
+  msg += std::to_string(fileList.size());
+  msg += " files converted";
+  if (nPresent > 0) {
+    msg += " (";
+    msg += std::to_string(nPresent);
+    msg += " already present in the bucket and not overwritten)";
+  }
+  msg += "\n";
 
-      // Success if none of the requested conversions failed
-      std::string msg;
-      if (nFiles == fileList.size()) msg = "Success: ";
-      else msg = "Error: only ";
-      msg += std::to_string(nFiles);
-      msg += " of ";
-      msg += std::to_string(fileList.size());
-      msg += " files converted\n";
-
-      response.body() = std::move(msg);
-      response.prepare_payload();
-      be::http::write(socket, response, ec);
-      if (ec) return report_error(ec, "write");
+  return msg;
+}
+
+// Everything the sessions share. Conversions run on their own pool so that the io threads, and with them
+// /ready and /metrics, stay responsive while files are being converted
+struct ServerState {
+  StorageClientGate& storage;
+  std::string bucket_name;
+  std::string raw_data_dir;
+  std::string traceFile;
+  std::chrono::seconds timeout;
+  int maxSessions;
+  int maxQueued;
+  CompositeUpload composite;
+  ConversionCache& cache;
+
+  // One worker: every conversion works through the same /r tree and uploads the same objects, so two at once
+  // would download over each other and race on the uploads. Requests queue behind it, up to maxQueued
+  asio::thread_pool convertPool{1};
+
+  std::atomic<int> sessions{0};
+  std::atomic<int> queued{0};
+  std::atomic<long> conversions{0};
+  std::atomic<long> rejected{0};
+};
+
+// Runs one conversion request (on the conversion pool) and fills in the response
+void convertRequest(ServerState& state, std::string const& target, be::http::status& status, std::string& msg) {
+  // Spans from this request onwards go in the trace, if one was asked for with ?trace=1 or CSV_TRACE_FILE
+  uint64_t sessionStart = trace::nowMicros();
+  std::string tracePath = state.traceFile;
+  if (queryParam(target, "trace") == "1" && tracePath.empty()) {
+    tracePath = "/tmp/csv_trace_" + std::to_string(sessionStart) + ".json";
+  }
+
+  try {
+    trace::Scope span("session", target);
+    auto client = [&state] {
+      trace::Scope span("client_wait");
+      return state.storage.wait();
+    }();
+    if (client) msg = convertBucket(*client, state.bucket_name, state.raw_data_dir, state.composite, state.cache);
+    else {
+      status = be::http::status::service_unavailable;
+      msg = "Error: storage client unavailable\n";
+    }
+  } catch (std::exception const& ex) {
+    std::cerr << "Conversion failed: " << ex.what() << "\n";
+    status = be::http::status::internal_server_error;
+    msg = "Error: ";
+    msg += ex.what();
+    msg += "\n";
+  }
+  state.conversions++;
+
+  if (!tracePath.empty()) {
+    if (trace::dumpChromeTrace(tracePath, sessionStart)) msg += "Trace written to " + tracePath + "\n";
+    else std::cerr << "Failed to write trace to " << tracePath << "\n";
+  }
+}
+
+// Prometheus text format
+std::string metricsText(ServerState& state) {
+  std::ostringstream os;
+  os << "csv_sessions_active " << state.sessions << "\n";
+  os << "csv_conversions_queued " << state.queued << "\n";
+  os << "csv_conversions_total " << state.conversions << "\n";
+  os << "csv_requests_rejected_total " << state.rejected << "\n";
+  os << "csv_cache_hits_total " << state.cache.hits() << "\n";
+  os << "csv_cache_misses_total " << state.cache.misses() << "\n";
+  os << "csv_cache_bytes " << state.cache.bytes() << "\n";
+  return std::move(os).str();
+}
+
+// One HTTP connection. All of its handlers run on the connection's strand
+class Session : public std::enable_shared_from_this<Session> {
+ public:
+  Session(tcp::socket&& socket, ServerState& state, bool overLimit)
+      : stream_(std::move(socket)), state_(state), overLimit_(overLimit) {
+    state_.sessions++;
+  }
+  ~Session() { state_.sessions--; }
+
+  void run() {
+    asio::dispatch(stream_.get_executor(), [self = shared_from_this()] { self->doRead(); });
+  }
+
+ private:
+  void doRead() {
+    request_ = {};
+    stream_.expires_after(state_.timeout);
+    be::http::async_read(stream_, buffer_, request_,
+                         [self = shared_from_this()](be::error_code ec, std::size_t) { self->onRead(ec); });
+  }
+
+  void onRead(be::error_code ec) {
+    if (ec == be::http::error::end_of_stream) return doClose();
+    if (ec) return reportError(ec, "read");
+
+    if (overLimit_) {
+      state_.rejected++;
+      return respond(be::http::status::service_unavailable, "Error: too many connections\n", true);
+    }
+
+    if (request_.method() == be::http::verb::get && request_.target() == "/ready") {
+      // Readiness probe: never blocks on the storage client
+      if (state_.storage.ready()) return respond(be::http::status::ok, "Ready\n");
+      return respond(be::http::status::service_unavailable, "Starting\n");
     }
-    socket.shutdown(tcp::socket::shutdown_send, ec);
-  };
-
-  asio::io_context ioc{/*concurrency_hint=*/1};
-  tcp::acceptor acceptor{ioc, {address, port}};
-  for (;;) {
-    auto socket = acceptor.accept(ioc);
-    if (!socket.is_open()) break;
-    // Run a thread per-session, transferring ownership of the socket
-    std::thread{handle_session, std::move(socket)}.detach();
+    if (request_.method() == be::http::verb::get && request_.target() == "/metrics") {
+      return respond(be::http::status::ok, metricsText(state_));
+    }
+
+    // Anything else is a conversion request
+    if (state_.queued++ >= state_.maxQueued) {
+      state_.queued--;
+      state_.rejected++;
+      return respond(be::http::status::service_unavailable, "Error: too many conversions queued\n");
+    }
+
+    // The conversion can take much longer than a request timeout; the timer restarts when we write the response
+    stream_.expires_never();
+    asio::post(state_.convertPool, [self = shared_from_this()] {
+      be::http::status status = be::http::status::ok;
+      std::string msg;
+      convertRequest(self->state_, std::string(self->request_.target()), status, msg);
+      self->state_.queued--;
+      asio::post(self->stream_.get_executor(), [self, status, msg = std::move(msg)]() mutable {
+        self->respond(status, std::move(msg));
+      });
+    });
   }
 
+  void respond(be::http::status status, std::string msg, bool close = false) {
+    auto response = std::make_shared<be::http::response<be::http::string_body>>(status, request_.version());
+    response->set(be::http::field::server, BOOST_BEAST_VERSION_STRING);
+    response->set(be::http::field::content_type, "text/plain");
+    response->keep_alive(request_.keep_alive() && !close);
+    response->body() = std::move(msg);
+    response->prepare_payload();
+
+    stream_.expires_after(state_.timeout);
+    be::http::async_write(stream_, *response,
+                          [self = shared_from_this(), response](be::error_code ec, std::size_t) {
+                            if (ec) return self->reportError(ec, "write");
+                            if (response->need_eof()) return self->doClose();
+                            self->doRead();
+                          });
+  }
+
+  void doClose() {
+    be::error_code ec;
+    stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+  }
+
+  void reportError(be::error_code ec, char const* what) {
+    std::cerr << what << ": " << ec.message() << "\n";
+  }
+
+  be::tcp_stream stream_;
+  be::flat_buffer buffer_;
+  be::http::request<be::http::string_body> request_;
+  ServerState& state_;
+  bool overLimit_;
+};
+
+// Accepts connections and starts a session for each, each on its own strand
+class Listener : public std::enable_shared_from_this<Listener> {
+ public:
+  Listener(asio::io_context& ioc, tcp::endpoint endpoint, ServerState& state)
+      : ioc_(ioc), acceptor_(asio::make_strand(ioc), endpoint), state_(state) {}
+
+  void run() { doAccept(); }
+
+ private:
+  void doAccept() {
+    acceptor_.async_accept(asio::make_strand(ioc_), [self = shared_from_this()](be::error_code ec, tcp::socket socket) {
+      if (ec) std::cerr << "accept: " << ec.message() << "\n";
+      else {
+        // Past the limit the connection still gets a 503, so the client isn't left hanging
+        bool overLimit = self->state_.sessions >= self->state_.maxSessions;
+        std::make_shared<Session>(std::move(socket), self->state_, overLimit)->run();
+      }
+      self->doAccept();
+    });
+  }
+
+  asio::io_context& ioc_;
+  tcp::acceptor acceptor_;
+  ServerState& state_;
+};
+
+
+int main(int argc, char* argv[]) try {
+
+  // These should be passed in as args
+  std::string const bucket_name = "edd23232";
+  std::string const raw_data_dir = "unprocessed";
+
+  po::variables_map vm = parse_args(argc, argv);
+
+  if (vm.count("help")) return 0;
+
+  // Bind the port before anything slow, so a cold start is accepting connections as soon as possible
+  auto address = asio::ip::make_address(vm["address"].as<std::string>());
+  auto port = vm["port"].as<std::uint16_t>();
+  auto threads = std::max(1, vm["threads"].as<int>());
+  asio::io_context ioc{threads};
+  StorageClientGate storage;
+  // Cheap: the cache dir is only scanned by the first conversion
+  ConversionCache cache(vm["cache-dir"].as<std::string>(), vm["cache-size"].as<std::uintmax_t>());
+
+  // Setting CSV_TRACE_FILE dumps a Chrome trace of every request to that path (overwritten each time)
+  auto const* traceEnv = std::getenv("CSV_TRACE_FILE");
+
+  ServerState state{storage, bucket_name, raw_data_dir, traceEnv == nullptr ? "" : traceEnv,
+                    std::chrono::seconds(vm["timeout"].as<int>()), vm["max-sessions"].as<int>(),
+                    vm["max-queued"].as<int>(),
+                    {vm["composite-threshold"].as<std::uintmax_t>(), std::min(32, vm["composite-parts"].as<int>())},
+                    cache};
+  std::make_shared<Listener>(ioc, tcp::endpoint{address, port}, state)->run();
+  std::cout << "Listening on " << address << ":" << port << std::endl;
+
+  // Create the first tier of the subdir structure (doesn't matter if it exists already)
+  boost::filesystem::create_directory(raw_data_dir);
+
+  // Setup the GCloud stuff in the background. Conversion requests wait for it; GET /ready reports whether it's done
+  storage.start(bucket_name, raw_data_dir);
+
+  std::vector<std::thread> pool;
+  for (int i = 1; i < threads; i++) pool.emplace_back([&ioc] { ioc.run(); });
+  ioc.run();
+  for (auto& t : pool) t.join();
 
   return 0;
 } catch (std::exception const& ex) {
   std::cerr << "Standard exception caught " << ex.what() << '\n';
   return 1;
-}
\ No newline at end of file
+}
@@ -0,0 +1,171 @@
+/*
+// Lightweight span tracing for the conversion hot path.
+// Each thread records spans into its own ring buffer, so recording never takes a lock. Rings are handed back to a
+// free list when their thread exits, so the short-lived threads started for every large file (formatting the parts in
+// convertFileParts, uploading them in UploadComposite) reuse rings instead of growing a new one each time.
+// dumpChromeTrace() writes the spans as Chrome trace JSON, which can be opened in Perfetto (ui.perfetto.dev) or chrome://tracing
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace trace {
+
+// One completed span. name must be a string literal; detail is copied (truncated) so it can be e.g. a file name
+struct Span {
+  const char* name;
+  char detail[96];
+  uint64_t start_us;
+  uint64_t dur_us;
+};
+
+// Oldest spans are overwritten once a thread has recorded more than this
+const size_t ringSize = 4096;
+
+struct Ring {
+  uint32_t tid;
+  std::atomic<uint64_t> head{0}; // total spans ever written; slot is head % ringSize
+  Span spans[ringSize];
+};
+
+// Microseconds since process start, on the monotonic clock
+inline uint64_t nowMicros() {
+  static const auto epoch = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+// All rings ever created (in use or free). Only touched when a thread first records, exits, or when dumping
+struct Registry {
+  std::mutex mu;
+  std::vector<Ring*> all;
+  std::vector<Ring*> free;
+};
+
+inline Registry& registry() {
+  static Registry* r = new Registry; // never destroyed, so detached threads can still release their rings at exit
+  return *r;
+}
+
+// Owns the calling thread's ring and returns it to the free list when the thread exits
+struct RingHolder {
+  Ring* ring = nullptr;
+
+  ~RingHolder() {
+    if (ring == nullptr) return;
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mu);
+    r.free.push_back(ring);
+  }
+};
+
+inline Ring& threadRing() {
+  thread_local RingHolder holder;
+  if (holder.ring == nullptr) {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mu);
+    if (!r.free.empty()) {
+      holder.ring = r.free.back();
+      r.free.pop_back();
+    } else {
+      holder.ring = new Ring;
+      holder.ring->tid = r.all.size() + 1;
+      r.all.push_back(holder.ring);
+    }
+  }
+  return *holder.ring;
+}
+
+inline void record(const char* name, const char* detail, uint64_t start_us, uint64_t end_us) {
+  Ring& ring = threadRing();
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  Span& span = ring.spans[head % ringSize];
+  span.name = name;
+  std::strncpy(span.detail, detail, sizeof(span.detail) - 1);
+  span.detail[sizeof(span.detail) - 1] = '\0';
+  span.start_us = start_us;
+  span.dur_us = end_us - start_us;
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+// Records the time between construction and destruction as one span
+class Scope {
+ public:
+  explicit Scope(const char* name, const std::string& detail = std::string())
+      : name_(name), detail_(detail), start_(nowMicros()) {}
+  ~Scope() { record(name_, detail_.c_str(), start_, nowMicros()); }
+
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+ private:
+  const char* name_;
+  std::string detail_;
+  uint64_t start_;
+};
+
+inline void writeJsonString(std::ostream& out, const char* s) {
+  out << '"';
+  for (; *s != '\0'; s++) {
+    char c = *s;
+    if (c == '"' || c == '\\') out << '\\' << c;
+    else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out << buf;
+    }
+    else out << c;
+  }
+  out << '"';
+}
+
+// Writes every span that started at or after since_us as Chrome trace JSON. Returns false if the file can't be written.
+// Best effort: a thread still recording while we dump may overwrite the oldest spans of its ring underneath us
+inline bool dumpChromeTrace(const std::string& path, uint64_t since_us = 0) {
+  std::vector<Ring*> rings;
+  {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mu);
+    rings = r.all;
+  }
+
+  std::ofstream out(path.c_str());
+  if (out.fail()) return false;
+
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  for (Ring* ring : rings) {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t oldest = head > ringSize ? head - ringSize : 0;
+    for (uint64_t i = oldest; i < head; i++) {
+      const Span& span = ring->spans[i % ringSize];
+      if (span.start_us < since_us) continue;
+
+      if (!first) out << ',';
+      first = false;
+      out << "\n{\"name\":";
+      writeJsonString(out, span.name);
+      out << ",\"cat\":\"csv\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->tid
+          << ",\"ts\":" << span.start_us << ",\"dur\":" << span.dur_us;
+      if (span.detail[0] != '\0') {
+        out << ",\"args\":{\"detail\":";
+        writeJsonString(out, span.detail);
+        out << '}';
+      }
+      out << '}';
+    }
+  }
+  out << "\n]}\n";
+
+  return !out.fail();
+}
+
+} // namespace trace